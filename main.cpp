@@ -1,8 +1,13 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <string.h>
+#include <thread>
 #include "coalescent.h"
 #include "common.h"
+#include "sequence.h"
 using namespace std;
 
 // CoaTran version
@@ -15,6 +20,26 @@ using namespace std;
 #define RNG_SEED_ENV_VAR "COATRAN_RNG_SEED"
 #endif
 
+// sequence evolution environment variables (sequences are only simulated if SEQ_FASTA_ENV_VAR is set)
+#ifndef SEQ_FASTA_ENV_VAR
+#define SEQ_FASTA_ENV_VAR "COATRAN_SEQ_FASTA"
+#endif
+#ifndef SEQ_LENGTH_ENV_VAR
+#define SEQ_LENGTH_ENV_VAR "COATRAN_SEQ_LENGTH"
+#endif
+#ifndef SEQ_RATE_ENV_VAR
+#define SEQ_RATE_ENV_VAR "COATRAN_SEQ_RATE"
+#endif
+#ifndef SEQ_MODEL_ENV_VAR
+#define SEQ_MODEL_ENV_VAR "COATRAN_SEQ_MODEL"
+#endif
+#ifndef SEQ_GAMMA_ENV_VAR
+#define SEQ_GAMMA_ENV_VAR "COATRAN_SEQ_GAMMA"
+#endif
+#ifndef SEQ_THREADS_ENV_VAR
+#define SEQ_THREADS_ENV_VAR "COATRAN_SEQ_THREADS"
+#endif
+
 // description
 #ifndef DESCRIPTION
 #define DESCRIPTION string("CoaTran v") + string(COATRAN_VERSION)
@@ -69,6 +94,14 @@ double eff_pop_growth;
 double eff_pop_size;
 #endif
 
+// declare extern global vars from sequence.h
+unsigned int seq_length = 0;
+double seq_rate = 1;
+double seq_exch[6] = {1, 1, 1, 1, 1, 1};
+double seq_freqs[4] = {0.25, 0.25, 0.25, 0.25};
+vector<double> seq_cat_rates = {1.};
+unsigned int seq_threads = 1;
+
 // main driver
 int main(int argc, char** argv) {
     // check usage
@@ -95,6 +128,47 @@ int main(int argc, char** argv) {
         }
     }
 
+    // check if user wants sequences evolved along the tree(s); validate everything before simulating anything
+    const char* const seq_fasta_env = getenv(SEQ_FASTA_ENV_VAR);
+    ofstream seq_file;
+    if(seq_fasta_env != nullptr) {
+        const char* const seq_length_env = getenv(SEQ_LENGTH_ENV_VAR);
+        const char* const seq_rate_env = getenv(SEQ_RATE_ENV_VAR);
+        const char* const seq_model_env = getenv(SEQ_MODEL_ENV_VAR);
+        const char* const seq_gamma_env = getenv(SEQ_GAMMA_ENV_VAR);
+        const char* const seq_threads_env = getenv(SEQ_THREADS_ENV_VAR);
+        if(seq_length_env == nullptr) {
+            cerr << SEQ_LENGTH_ENV_VAR << " must be set when " << SEQ_FASTA_ENV_VAR << " is set" << endl; exit(1);
+        }
+        double const tmp_length = parse_seq_number(seq_length_env, SEQ_LENGTH_ENV_VAR);
+        if(!(tmp_length >= 1 && tmp_length <= numeric_limits<unsigned int>::max() && tmp_length == floor(tmp_length))) {
+            cerr << SEQ_LENGTH_ENV_VAR << " must be a positive integer: " << seq_length_env << endl; exit(1);
+        }
+        seq_length = tmp_length;
+        if(seq_rate_env != nullptr) {
+            seq_rate = parse_seq_number(seq_rate_env, SEQ_RATE_ENV_VAR);
+            if(seq_rate < 0) {
+                cerr << SEQ_RATE_ENV_VAR << " must be non-negative: " << seq_rate_env << endl; exit(1);
+            }
+        }
+        if(seq_model_env != nullptr) {
+            parse_seq_model(seq_model_env);
+        }
+        if(seq_gamma_env != nullptr) {
+            parse_seq_gamma(seq_gamma_env);
+        }
+        prepare_rate_matrix();
+        if(seq_threads_env == nullptr) {
+            seq_threads = max(1u, thread::hardware_concurrency());
+        } else {
+            double const tmp_threads = parse_seq_number(seq_threads_env, SEQ_THREADS_ENV_VAR);
+            if(!(tmp_threads >= 1 && tmp_threads <= numeric_limits<unsigned int>::max() && tmp_threads == floor(tmp_threads))) {
+                cerr << SEQ_THREADS_ENV_VAR << " must be a positive integer: " << seq_threads_env << endl; exit(1);
+            }
+            seq_threads = tmp_threads;
+        }
+    }
+
     // check if files exist
     if(!file_exists(argv[1])) {
         cerr << "File not found: " << argv[1] << endl; exit(1);
@@ -103,6 +177,14 @@ int main(int argc, char** argv) {
         cerr << "File not found: " << argv[2] << endl; exit(1);
     }
 
+    // open the FASTA output only once the inputs are known to exist, so a failed run doesn't clobber it
+    if(seq_fasta_env != nullptr) {
+        seq_file.open(seq_fasta_env);
+        if(!seq_file) {
+            cerr << "Unable to write file: " << seq_fasta_env << endl; exit(1);
+        }
+    }
+
     // parse parameter(s)
     #if defined EXPGROWTH   // exponential effective population size growth
         init_eff_pop_size = atof(argv[3]);
@@ -139,5 +221,10 @@ int main(int argc, char** argv) {
             cout << s << endl;
         }
     }
+
+    // evolve sequences along the phylogenies and output the leaf sequences as FASTA
+    if(seq_fasta_env != nullptr) {
+        evolve_sequences(roots, phylo, seq_file);
+    }
     return 0;
 }
@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "common.h"
+#include "sequence.h"
+
+// nucleotides in the order of their 2-bit encoding
+const char NUCLEOTIDES[] = "ACGT";
+
+// scale a 32-bit random integer to [0,1) (32 random bits are plenty for choosing a nucleotide)
+const double SEQ_UNIFORM_SCALE = 1. / 4294967296.;
+
+// one step of the (precomputed) pre-order traversal: sequences are evolved from slot parent_slot into slot (or leaf)
+struct seq_step {
+    int node;          // index of the node in phylo
+    int parent_slot;   // scratch slot holding the parent's sequence (-1 if root)
+    int slot;          // scratch slot to hold this node's sequence (-1 if leaf)
+    int leaf;          // index of this node in the leaf output (-1 if not leaf)
+    double length;     // length of the branch above this node (in units of time; -1 if root)
+    double max_change; // maximum substitution probability over all sites of the branch (only set if tables are shared)
+};
+
+// eigendecomposition of the symmetrized rate matrix, so P(t) = exp(Qt) is cheap to compute per branch
+double SEQ_EVAL[4];          // eigenvalues
+double SEQ_EVEC[4][4];       // eigenvectors (as columns)
+double SEQ_SQRT_RATIO[4][4]; // sqrt(pi_j / pi_i)
+
+double parse_seq_number(string const & s, string const & what) {
+    double x; size_t len = 0;
+    try {
+        x = stod(s, &len);
+    } catch(...) {
+        len = 0;
+    }
+    if(len == 0 || len != s.size() || !isfinite(x)) {
+        cerr << "Invalid number in " << what << ": " << s << endl; exit(1);
+    }
+    return x;
+}
+
+// parse comma-separated numbers (after the model name) from a specification string
+vector<double> parse_seq_params(string const & spec, string const & what, string & name) {
+    istringstream is(spec); string tmp; vector<double> params;
+    getline(is, name, ',');
+    while(getline(is, tmp, ',')) {
+        params.push_back(parse_seq_number(tmp, what));
+    }
+    if(!spec.empty() && spec.back() == ',') { // getline drops a trailing empty field
+        parse_seq_number("", what);
+    }
+    return params;
+}
+
+void parse_seq_model(char const * const spec) {
+    string name; vector<double> const params = parse_seq_params(spec, string("substitution model ") + spec, name);
+    if((name == "JC69" || name == "JC") && params.empty()) {
+        for(unsigned int i = 0; i < 6; ++i) { seq_exch[i] = 1; }
+        for(unsigned int i = 0; i < 4; ++i) { seq_freqs[i] = 0.25; }
+    } else if((name == "HKY" || name == "HKY85") && params.size() == 5) {
+        for(unsigned int i = 0; i < 6; ++i) { seq_exch[i] = 1; }
+        seq_exch[1] = params[0]; seq_exch[4] = params[0]; // transitions (AG and CT)
+        for(unsigned int i = 0; i < 4; ++i) { seq_freqs[i] = params[i+1]; }
+    } else if(name == "GTR" && params.size() == 10) {
+        for(unsigned int i = 0; i < 6; ++i) { seq_exch[i] = params[i]; }
+        for(unsigned int i = 0; i < 4; ++i) { seq_freqs[i] = params[i+6]; }
+    } else {
+        cerr << "Invalid substitution model: " << spec << endl; exit(1);
+    }
+
+    // check for validity and normalize base frequencies
+    double freq_sum = 0;
+    for(unsigned int i = 0; i < 6; ++i) {
+        if(seq_exch[i] < 0) {
+            cerr << "Substitution model rates must be non-negative: " << spec << endl; exit(1);
+        }
+    }
+    for(unsigned int i = 0; i < 4; ++i) {
+        if(seq_freqs[i] <= 0) {
+            cerr << "Base frequencies must be positive: " << spec << endl; exit(1);
+        }
+        freq_sum += seq_freqs[i];
+    }
+    for(unsigned int i = 0; i < 4; ++i) {
+        seq_freqs[i] /= freq_sum;
+    }
+}
+
+// regularized lower incomplete gamma function P(a,x)
+double incomplete_gamma(double const a, double const x) {
+    if(x <= 0) {
+        return 0;
+    }
+    double const log_prefix = -x + a*log(x) - lgamma(a);
+
+    // series representation
+    if(x < a+1) {
+        double ap = a; double del = 1./a; double sum = del;
+        for(unsigned int i = 0; i < 1000 && fabs(del) > fabs(sum)*1e-15; ++i) {
+            ap += 1; del *= x/ap; sum += del;
+        }
+        return sum * exp(log_prefix);
+    }
+
+    // continued fraction representation (modified Lentz)
+    double const FPMIN = 1e-300;
+    double b = x+1-a; double c = 1./FPMIN; double d = 1./b; double h = d;
+    for(unsigned int i = 1; i <= 1000; ++i) {
+        double const an = -(i*(i-a));
+        b += 2; d = an*d + b; c = b + an/c;
+        if(fabs(d) < FPMIN) { d = FPMIN; }
+        if(fabs(c) < FPMIN) { c = FPMIN; }
+        d = 1./d; double const del = d*c; h *= del;
+        if(fabs(del-1) < 1e-15) {
+            break;
+        }
+    }
+    return 1. - exp(log_prefix)*h;
+}
+
+void parse_seq_gamma(char const * const spec) {
+    string const what = string("gamma rate heterogeneity ") + spec;
+    string alpha_str; vector<double> const params = parse_seq_params(spec, what, alpha_str);
+    double const alpha = parse_seq_number(alpha_str, what); unsigned int K = DEFAULT_SEQ_GAMMA_CATEGORIES;
+    if(params.size() > 1 || !(alpha > 0)) {
+        cerr << "Invalid gamma rate heterogeneity: " << spec << endl; exit(1);
+    }
+    if(params.size() == 1) {
+        // number of categories must be a positive integer that fits in the per-site category bytes
+        if(!(params[0] >= 1 && params[0] <= 255 && params[0] == floor(params[0]))) {
+            cerr << "Number of gamma rate categories must be an integer between 1 and 255: " << spec << endl; exit(1);
+        }
+        K = (unsigned int)params[0];
+    }
+
+    // category boundaries are quantiles of Gamma(alpha, rate alpha), found via bisection
+    vector<double> bounds(K+1, 0.); bounds[K] = DOUBLE_INFINITY;
+    for(unsigned int i = 1; i < K; ++i) {
+        double const p = double(i) / K; double lo = 0; double hi = 1;
+        while(incomplete_gamma(alpha, alpha*hi) < p) {
+            hi *= 2;
+        }
+        for(unsigned int j = 0; j < 100; ++j) {
+            double const mid = (lo+hi) / 2;
+            if(incomplete_gamma(alpha, alpha*mid) < p) { lo = mid; } else { hi = mid; }
+        }
+        bounds[i] = (lo+hi) / 2;
+    }
+
+    // rate of each category is the mean of the gamma distribution within it (Yang 1994)
+    seq_cat_rates = vector<double>(K, 0.); double rate_sum = 0;
+    for(unsigned int i = 0; i < K; ++i) {
+        double const upper = (i == K-1) ? 1. : incomplete_gamma(alpha+1, alpha*bounds[i+1]);
+        seq_cat_rates[i] = K * (upper - incomplete_gamma(alpha+1, alpha*bounds[i]));
+        rate_sum += seq_cat_rates[i];
+    }
+    for(unsigned int i = 0; i < K; ++i) {
+        seq_cat_rates[i] *= K / rate_sum;
+    }
+}
+
+// eigendecomposition of a symmetric 4x4 matrix A via cyclic Jacobi rotations (A is destroyed)
+void jacobi_eigen(double A[4][4], double evec[4][4], double eval[4]) {
+    for(unsigned int i = 0; i < 4; ++i) {
+        for(unsigned int j = 0; j < 4; ++j) {
+            evec[i][j] = (i == j) ? 1 : 0;
+        }
+    }
+    for(unsigned int sweep = 0; sweep < 100; ++sweep) {
+        double off = 0;
+        for(unsigned int p = 0; p < 4; ++p) {
+            for(unsigned int q = p+1; q < 4; ++q) {
+                off += fabs(A[p][q]);
+            }
+        }
+        if(off < 1e-15) {
+            break;
+        }
+        for(unsigned int p = 0; p < 4; ++p) {
+            for(unsigned int q = p+1; q < 4; ++q) {
+                if(fabs(A[p][q]) < 1e-300) {
+                    continue;
+                }
+                double const theta = (A[q][q]-A[p][p]) / (2*A[p][q]);
+                double const t = ((theta < 0) ? -1. : 1.) / (fabs(theta) + sqrt(theta*theta+1));
+                double const c = 1. / sqrt(t*t+1); double const s = t*c;
+                for(unsigned int k = 0; k < 4; ++k) {
+                    double const akp = A[k][p]; double const akq = A[k][q];
+                    A[k][p] = c*akp - s*akq; A[k][q] = s*akp + c*akq;
+                }
+                for(unsigned int k = 0; k < 4; ++k) {
+                    double const apk = A[p][k]; double const aqk = A[q][k];
+                    A[p][k] = c*apk - s*aqk; A[q][k] = s*apk + c*aqk;
+                }
+                for(unsigned int k = 0; k < 4; ++k) {
+                    double const vkp = evec[k][p]; double const vkq = evec[k][q];
+                    evec[k][p] = c*vkp - s*vkq; evec[k][q] = s*vkp + c*vkq;
+                }
+            }
+        }
+    }
+    for(unsigned int i = 0; i < 4; ++i) {
+        eval[i] = A[i][i];
+    }
+}
+
+void prepare_rate_matrix() {
+    // Q_ij = exch_ij * pi_j for i != j, with exchangeabilities indexed AC, AG, AT, CG, CT, GT
+    int const EXCH_IND[4][4] = {{-1,0,1,2}, {0,-1,3,4}, {1,3,-1,5}, {2,4,5,-1}};
+    double Q[4][4]; double mu = 0;
+    for(unsigned int i = 0; i < 4; ++i) {
+        Q[i][i] = 0;
+        for(unsigned int j = 0; j < 4; ++j) {
+            if(i != j) {
+                Q[i][j] = seq_exch[EXCH_IND[i][j]] * seq_freqs[j]; Q[i][i] -= Q[i][j];
+            }
+        }
+        mu -= seq_freqs[i] * Q[i][i];
+    }
+    if(mu < ZERO_TOLERANCE_RATE) {
+        cerr << "Substitution model has no substitutions" << endl; exit(1);
+    }
+
+    // symmetrize as B = diag(pi)^(1/2) Q diag(pi)^(-1/2), so P(t) = diag(pi)^(-1/2) V exp(Dt) V^T diag(pi)^(1/2)
+    double B[4][4];
+    for(unsigned int i = 0; i < 4; ++i) {
+        for(unsigned int j = 0; j < 4; ++j) {
+            B[i][j] = (i == j) ? (Q[i][i] / mu) : (seq_exch[EXCH_IND[i][j]] * sqrt(seq_freqs[i]*seq_freqs[j]) / mu);
+            SEQ_SQRT_RATIO[i][j] = sqrt(seq_freqs[j] / seq_freqs[i]);
+        }
+    }
+    jacobi_eigen(B, SEQ_EVEC, SEQ_EVAL);
+}
+
+// compute transition probabilities P[i*4+j] = P(i -> j) after branch length t
+void transition_probs(double const t, double * const P) {
+    double exp_eval[4];
+    for(unsigned int k = 0; k < 4; ++k) {
+        exp_eval[k] = exp(SEQ_EVAL[k] * t);
+    }
+    for(unsigned int i = 0; i < 4; ++i) {
+        double row_sum = 0;
+        for(unsigned int j = 0; j < 4; ++j) {
+            double p = 0;
+            for(unsigned int k = 0; k < 4; ++k) {
+                p += SEQ_EVEC[i][k] * SEQ_EVEC[j][k] * exp_eval[k];
+            }
+            P[i*4+j] = max(0., p * SEQ_SQRT_RATIO[i][j]); row_sum += P[i*4+j];
+        }
+        for(unsigned int j = 0; j < 4; ++j) {
+            P[i*4+j] /= row_sum;
+        }
+    }
+}
+
+// build the sampling tables of one branch (or the root, if length < 0) into tables, and return the maximum change probability
+// tables are indexed by (category*4 + parent nucleotide): cum = cumulative P(i -> 0..j), change = P(i -> not i), and
+// swap_cum = cumulative P(i -> k-th other nucleotide | change), laid out as [cum (K*12) | change (K*4) | swap_cum (K*8)]
+double build_tables(double const length, double * const tables) {
+    unsigned int const K = seq_cat_rates.size();
+    double * const cum = tables; double * const change = tables + K*12; double * const swap_cum = tables + K*16;
+
+    // root sequences are sampled from the base frequencies
+    if(length < 0) {
+        for(unsigned int i = 0; i < K*4; ++i) {
+            cum[i*3] = seq_freqs[0];
+            cum[i*3+1] = seq_freqs[0] + seq_freqs[1];
+            cum[i*3+2] = seq_freqs[0] + seq_freqs[1] + seq_freqs[2];
+        }
+        return 1;
+    }
+
+    // otherwise, use the transition probabilities of each category
+    double P[16]; double max_change = 0;
+    for(unsigned int c = 0; c < K; ++c) {
+        transition_probs(seq_rate * seq_cat_rates[c] * length, P);
+        for(unsigned int i = 0; i < 4; ++i) {
+            unsigned int const ind = c*4 + i;
+            cum[ind*3] = P[i*4]; cum[ind*3+1] = cum[ind*3] + P[i*4+1]; cum[ind*3+2] = cum[ind*3+1] + P[i*4+2];
+            change[ind] = 1. - P[i*4+i]; max_change = max(max_change, change[ind]);
+            double const o0 = P[i*4 + ((i == 0) ? 1 : 0)]; double const o1 = P[i*4 + ((i <= 1) ? 2 : 1)];
+            swap_cum[ind*2] = (change[ind] > 0) ? (o0 / change[ind]) : 1.;
+            swap_cum[ind*2+1] = (change[ind] > 0) ? ((o0+o1) / change[ind]) : 1.;
+        }
+    }
+    return max_change;
+}
+
+// evolve one block of words along every step of the traversal
+void evolve_block(unsigned int const block, uint64_t const num_words, vector<seq_step> const & steps, vector<double> const & tables, vector<uint64_t> & scratch, vector<uint64_t> & leaf_seqs) {
+    // each block has its own RNG stream, so output doesn't depend on the number of threads
+    seed_seq rng_seq = {(unsigned int)RNG_SEED, block};
+    mt19937 rng(rng_seq);
+    unsigned int const K = seq_cat_rates.size();
+    uint64_t const start = (uint64_t)block * SEQ_BLOCK_WORDS;
+    unsigned int const block_words = min((uint64_t)SEQ_BLOCK_WORDS, num_words - start);
+    unsigned int const num_sites = block_words * 32;
+
+    // sample site rate categories
+    unsigned char cats[SEQ_BLOCK_WORDS*32] = {0};
+    if(K > 1) {
+        uniform_int_distribution<int> cat_rv(0, K-1);
+        for(unsigned int i = 0; i < num_sites; ++i) {
+            cats[i] = cat_rv(rng);
+        }
+    }
+
+    // tables are either shared across blocks (one per step) or rebuilt here for each step
+    vector<double> local_tables(tables.empty() ? K*24 : 0);
+
+    // evolve sequences in pre-order
+    for(unsigned int s = 0; s < steps.size(); ++s) {
+        seq_step const & step = steps[s];
+        uint64_t * const seq = (step.leaf == -1) ? (scratch.data() + step.slot*SEQ_BLOCK_WORDS) : (leaf_seqs.data() + (uint64_t)step.leaf*num_words + start);
+        uint64_t const * const parent_seq = (step.parent_slot == -1) ? nullptr : (scratch.data() + step.parent_slot*SEQ_BLOCK_WORDS);
+        double const * const cum = tables.empty() ? local_tables.data() : (tables.data() + (uint64_t)s*K*24);
+        double const * const change = cum + K*12; double const * const swap_cum = cum + K*16;
+        double const max_change = tables.empty() ? build_tables(step.length, local_tables.data()) : step.max_change;
+
+        // short branch: copy the parent and only visit candidate sites, found by geometric skipping with rate max_change,
+        // and accept a substitution at each with probability change/max_change (exact thinning)
+        if(max_change < SEQ_SPARSE_THRESHOLD) {
+            for(unsigned int w = 0; w < block_words; ++w) {
+                seq[w] = parent_seq[w];
+            }
+            if(max_change <= 0) {
+                continue;
+            }
+            double const log_stay = log1p(-max_change); double pos = -1;
+            while(true) {
+                pos += 1 + floor(log(1. - rng()*SEQ_UNIFORM_SCALE) / log_stay);
+                if(pos >= num_sites) {
+                    break;
+                }
+                unsigned int const site = pos; unsigned int const w = site / 32; unsigned int const shift = 2 * (site % 32);
+                uint64_t const from = (seq[w] >> shift) & 3;
+                unsigned int const ind = cats[site]*4 + from;
+                double const u = rng() * SEQ_UNIFORM_SCALE * max_change;
+                if(u < change[ind]) {
+                    double const v = u / change[ind];
+                    uint64_t const k = (v >= swap_cum[ind*2]) + (v >= swap_cum[ind*2+1]);
+                    uint64_t const to = k + (k >= from); // k-th nucleotide other than from
+                    seq[w] ^= (from ^ to) << shift;
+                }
+            }
+            continue;
+        }
+
+        // long branch (or root): sample every site from its cumulative transition probabilities
+        for(unsigned int w = 0; w < block_words; ++w) {
+            uint64_t const in = (parent_seq == nullptr) ? 0 : parent_seq[w]; uint64_t out = 0;
+            unsigned char const * const word_cats = cats + w*32;
+            for(unsigned int j = 0; j < 32; ++j) {
+                double const * const row = cum + (word_cats[j]*4 + ((in >> (2*j)) & 3))*3;
+                double const u = rng() * SEQ_UNIFORM_SCALE;
+                uint64_t const nuc = (u >= row[0]) + (u >= row[1]) + (u >= row[2]);
+                out |= nuc << (2*j);
+            }
+            seq[w] = out;
+        }
+    }
+}
+
+void evolve_sequences(vector<int> const & roots, vector<tuple<int,int,double,int>> const & phylo, ostream & out) {
+    // precompute the pre-order traversal, reusing scratch slots once all of a node's children are done
+    vector<seq_step> steps; steps.reserve(phylo.size());
+    vector<int> slot_refs; vector<int> free_slots; int num_leaves = 0;
+    vector<tuple<int,int,double>> stack; // <node,parent_slot,parent_time>
+    for(int const root : roots) {
+        if(root == -1) {
+            continue;
+        }
+        stack.push_back(make_tuple(root, -1, 0.));
+        while(!stack.empty()) {
+            int const node = get<0>(stack.back()); int const parent_slot = get<1>(stack.back()); double const parent_time = get<2>(stack.back()); stack.pop_back();
+            int const left = get<0>(phylo[node]); int const right = get<1>(phylo[node]); double const time = get<2>(phylo[node]);
+            seq_step step; step.node = node; step.parent_slot = parent_slot; step.slot = -1; step.leaf = -1; step.max_change = 0;
+            step.length = (parent_slot == -1) ? -1. : max(0., time - parent_time);
+
+            // leaves are written straight into the leaf output; internal nodes need a scratch slot
+            if(left == -1 && right == -1) {
+                step.leaf = num_leaves++;
+            } else {
+                if(free_slots.empty()) {
+                    step.slot = slot_refs.size(); slot_refs.push_back(0);
+                } else {
+                    step.slot = free_slots.back(); free_slots.pop_back();
+                }
+                slot_refs[step.slot] = (left == right) ? 1 : 2;
+            }
+            if(parent_slot != -1 && --slot_refs[parent_slot] == 0) {
+                free_slots.push_back(parent_slot);
+            }
+            steps.push_back(step);
+
+            // dummy transmission event nodes have a single child
+            if(step.slot != -1) {
+                stack.push_back(make_tuple(left, step.slot, time));
+                if(right != left) {
+                    stack.push_back(make_tuple(right, step.slot, time));
+                }
+            }
+        }
+    }
+
+    // evolve blocks of sites in parallel; leaf sequences are bit-packed (2 bits per site, 32 sites per word)
+    uint64_t const num_words = ((uint64_t)seq_length + 31) / 32;
+    unsigned int const num_blocks = (num_words + SEQ_BLOCK_WORDS - 1) / SEQ_BLOCK_WORDS;
+
+    // sampling tables only depend on the branch, so if there are multiple blocks and the tables of every branch fit in
+    // SEQ_TABLE_MEMORY, build them once and share them across blocks (otherwise, each block rebuilds them as it goes)
+    unsigned int const K = seq_cat_rates.size();
+    uint64_t const table_size = (uint64_t)steps.size() * K * 24;
+    vector<double> tables;
+    if(num_blocks > 1 && table_size * sizeof(double) <= (uint64_t)SEQ_TABLE_MEMORY) {
+        tables = vector<double>(table_size);
+        for(unsigned int s = 0; s < steps.size(); ++s) {
+            steps[s].max_change = build_tables(steps[s].length, tables.data() + (uint64_t)s*K*24);
+        }
+    }
+
+    unsigned int const num_slots = slot_refs.size();
+    vector<uint64_t> leaf_seqs((uint64_t)num_leaves * num_words, 0);
+    atomic<unsigned int> next_block(0);
+    auto worker = [&]() {
+        vector<uint64_t> scratch((uint64_t)num_slots * SEQ_BLOCK_WORDS);
+        for(unsigned int block = next_block++; block < num_blocks; block = next_block++) {
+            evolve_block(block, num_words, steps, tables, scratch, leaf_seqs);
+        }
+    };
+    unsigned int const num_threads = max(1u, min(seq_threads, num_blocks));
+    vector<thread> threads;
+    for(unsigned int i = 1; i < num_threads; ++i) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for(thread & t : threads) {
+        t.join();
+    }
+
+    // output leaf sequences as FASTA, labeled NODE|PERSON|TIME as in the Newick output
+    string s(seq_length, 'N');
+    for(seq_step const & step : steps) {
+        if(step.leaf == -1) {
+            continue;
+        }
+        int const person = get<3>(phylo[step.node]);
+        if(person == -1) {
+            cerr << "Encountered a leaf not associated with a person" << endl; exit(1);
+        }
+        uint64_t const * const seq = leaf_seqs.data() + (uint64_t)step.leaf*num_words;
+        for(unsigned int i = 0; i < seq_length; ++i) {
+            s[i] = NUCLEOTIDES[(seq[i/32] >> (2*(i%32))) & 3];
+        }
+        out << '>' << step.node << '|' << num2name[person] << '|' << to_string(get<2>(phylo[step.node])) << '\n' << s << '\n';
+    }
+    out.flush();
+}
@@ -0,0 +1,74 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <vector>
+using namespace std;
+
+// number of gamma rate categories if the user doesn't specify one
+#ifndef DEFAULT_SEQ_GAMMA_CATEGORIES
+#define DEFAULT_SEQ_GAMMA_CATEGORIES 4
+#endif
+
+// number of 64-bit words (32 sites each) evolved together as one parallel task
+#ifndef SEQ_BLOCK_WORDS
+#define SEQ_BLOCK_WORDS 64
+#endif
+
+// maximum memory (in bytes) for sharing every branch's sampling tables across blocks, rather than rebuilding them per block
+#ifndef SEQ_TABLE_MEMORY
+#define SEQ_TABLE_MEMORY 268435456
+#endif
+
+// branches whose maximum per-site substitution probability is below this only visit sites that might change
+#ifndef SEQ_SPARSE_THRESHOLD
+#define SEQ_SPARSE_THRESHOLD 0.2
+#endif
+
+// global variables related to sequence evolution
+extern unsigned int seq_length;      // Number of sites in each sequence
+extern double seq_rate;              // Expected number of substitutions per site per unit time
+extern double seq_exch[6];           // GTR exchangeabilities in the order AC, AG, AT, CG, CT, GT
+extern double seq_freqs[4];          // Equilibrium base frequencies in the order A, C, G, T
+extern vector<double> seq_cat_rates; // Relative rate of each site rate category (mean 1)
+extern unsigned int seq_threads;     // Number of threads to use when evolving sequences
+
+/**
+ * Parse a finite number, exiting with an error if the entire string isn't a valid number
+ * @param s The string to parse
+ * @param what A description of what is being parsed (for the error message)
+ * @return The parsed number
+ */
+double parse_seq_number(string const & s, string const & what);
+
+/**
+ * Parse a substitution model specification into seq_exch and seq_freqs
+ * Accepted formats: "JC69", "HKY,kappa,piA,piC,piG,piT", or "GTR,AC,AG,AT,CG,CT,GT,piA,piC,piG,piT"
+ * @param spec The model specification string
+ */
+void parse_seq_model(char const * const spec);
+
+/**
+ * Parse a gamma rate heterogeneity specification into seq_cat_rates (discrete gamma, mean of each category)
+ * Accepted formats: "alpha" or "alpha,num_categories"
+ * @param spec The rate heterogeneity specification string
+ */
+void parse_seq_gamma(char const * const spec);
+
+/**
+ * Build and decompose the rate matrix from seq_exch and seq_freqs (call after parsing, before evolve_sequences)
+ * Exits with an error if the model has no substitutions
+ */
+void prepare_rate_matrix();
+
+/**
+ * Evolve sequences down a phylo vector of <left,right,time,person> tuples and output the leaf sequences as FASTA
+ * Root sequences are sampled from the equilibrium base frequencies, and leaves are labeled as in the Newick output
+ * All sequence parameters must already be valid, and prepare_rate_matrix() must already have been called
+ * @param roots The root indices (in phylo) of the trees along which to evolve sequences (-1 entries are skipped)
+ * @param phylo The phylo vector
+ * @param out The stream to which to write the FASTA output
+ */
+void evolve_sequences(vector<int> const & roots, vector<tuple<int,int,double,int>> const & phylo, ostream & out);
+#endif